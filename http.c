@@ -9,16 +9,20 @@
 //Stdlib
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 //LwIP
 #include <lwip/ip_addr.h>
 #include <lwip/dhcp.h>
 #include <lwip/tcpip.h>
 #include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
 #include <lwip/inet.h>
 #include <lwip/udp.h>
 #include <lwip/dns.h>
 #include <lwip/sys.h>
+#include <lwip/memp.h>
+#include <lwip/stats.h>
 
 #include "ethernet/netconf.h"
 #include "rtc.h"
@@ -27,8 +31,48 @@
 
 #include "http.h"
 
+#if HTTP_TLS
+#include <mbedtls/version.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/net_sockets.h>
+/* _tls_step reads ssl.state and ssl.handshake->resume, which are only
+   reachable through this header in 2.x (3.x makes them private) */
+#include <mbedtls/ssl_internal.h>
+#if MBEDTLS_VERSION_MAJOR != 2
+#error "the tls transport uses mbedTLS 2.x internals, see _tls_step"
+#endif
+#endif
+
+#if !MEMP_STATS || !MEM_STATS
+#error "the pacer reads pool occupancy from lwip_stats, set MEMP_STATS and MEM_STATS in lwipopts.h"
+#endif
+
 static uint32_t tmr = 0;
 static uint8_t lwip_init=0; /**< flag to avoid calling lwip init multiple times*/
+static http_sock_t * sock_list = NULL; /**< sockets registered with http_init*/
+static http_pace_t pace = { .window = HTTP_PACE_MIN_WND };
+#if HTTP_TLS
+/**
+ * @brief session kept for a server, so reconnects skip the full handshake
+ */
+typedef struct tls_cache {
+  uint32_t ip;                  /**< server ip*/
+  uint32_t port;                /**< server port*/
+  uint8_t valid;                /**< entry in use*/
+  mbedtls_ssl_session session;  /**< session id / ticket and master secret*/
+} tls_cache_t;
+
+static mbedtls_ssl_config tls_conf;
+static mbedtls_entropy_context tls_entropy;
+static mbedtls_ctr_drbg_context tls_drbg;
+static mbedtls_x509_crt tls_ca;
+static tls_cache_t tls_cache[HTTP_TLS_CACHE_LEN];
+static uint8_t tls_cache_next = 0;
+static http_tls_t tls_stats;
+static uint8_t tls_ready = 0; /* http_tls_init done */
+#endif
 
 /*---------- local functions ---------*/
 void _dummy(uint16_t resultcode, void * arg)
@@ -40,6 +84,28 @@ err_t _dummy2(void *arg, struct tcp_pcb * tpcb)
   return ERR_OK;
 }
 
+/**
+ * @brief detach the pcb from its socket and close it. The state hack keeps
+ * the pcb alive a while, a late error or timeout on it must not reach the
+ * socket, which may be running its next connection by then.
+ */
+static void _pcb_detach(struct tcp_pcb * tpcb)
+{
+  tcp_arg(tpcb, NULL);
+  tcp_sent(tpcb, NULL);
+  tcp_recv(tpcb, NULL);
+  tcp_err(tpcb, NULL);
+  tcp_poll(tpcb, _dummy2, 20);/*remove idle callback*/
+}
+
+static void _pcb_close(struct tcp_pcb * tpcb)
+{
+  _pcb_detach(tpcb);
+  tpcb->state=8;/*Closing, BUG: needed because of bug in TCP/IP stack that
+  causes circular list to form (with a neverending check loop)*/
+  tcp_close(tpcb);
+}
+
 /* --- Internal Use prototypes --- */
 err_t _connected(void *arg, struct tcp_pcb *tpcb, err_t err);
 err_t _sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len);
@@ -47,11 +113,207 @@ err_t _recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *recv, err_t err);
 err_t _poll_cb(void *arg, struct tcp_pcb *tpcb);
 err_t _accept(void *arg, struct tcp_pcb *newpcb, err_t err);
 void _err(void *arg, err_t err);
+static err_t _start_connect(http_sock_t * sock);
+static err_t _pace_write(http_sock_t * sock);
+static int _sock_ready(http_sock_t * sock);
+static void _host_str(http_sock_t * sock, char * host);
+static int _submit(http_sock_t * sock);
+#if HTTP_WS
+static err_t _ws_recv(http_sock_t * sock, struct tcp_pcb * tpcb, struct pbuf * recv);
+static void _ws_keepalive(http_sock_t * sock, uint32_t now);
+#endif
+#if HTTP_TLS
+static err_t _tls_start(http_sock_t * sock);
+static err_t _tls_step(http_sock_t * sock);
+static err_t _tls_write(http_sock_t * sock);
+static err_t _tls_recv(http_sock_t * sock, struct tcp_pcb * tpcb, struct pbuf * recv);
+static void _tls_close(http_sock_t * sock);
+static void _tls_reset(http_sock_t * sock);
+static int _tls_bio_send(void * ctx, const unsigned char * buf, size_t len);
+static int _tls_bio_recv(void * ctx, unsigned char * buf, size_t len);
+#endif
+
+/*---------- pacing ---------*/
+
+/**
+ * @brief buffer index of a payload counter, websocket traffic uses the payload
+ * as a ring and the counters run up to twice its size
+ */
+static uint16_t _tx_idx(uint16_t c)
+{
+  return c >= HTTP_MAX_PAYLOAD_LEN ? c - HTTP_MAX_PAYLOAD_LEN : c;
+}
+
+/* occupancy (%) of one pool, 0 when it is not accounted */
+static uint8_t _pace_pct(uint32_t used, uint32_t avail)
+{
+  if(avail == 0) { return 0; }
+  return used >= avail ? 100 : (used * 100u) / avail;
+}
+
+/**
+ * @brief sample occupancy (%) of everything that can fail a request with
+ * ERR_MEM, the worst one wins:
+ * - MEMP_TCP_PCB: tcp_new (TIME_WAIT pcbs don't count, tcp_alloc recycles them)
+ * - MEMP_TCP_SEG and MEMP_PBUF: segments and the PBUF_ROM refs of no-copy writes
+ * - heap: segment headers and copied writes (tls records)
+ * - MEMP_PBUF_POOL: receive buffers
+ */
+static uint8_t _pace_pool_pct(void)
+{
+  const uint8_t pools[] = { MEMP_TCP_SEG, MEMP_PBUF, MEMP_PBUF_POOL };
+  struct stats_mem * m = &lwip_stats.memp[MEMP_TCP_PCB];
+  struct tcp_pcb * tw;
+  uint32_t used = m->used;
+  uint8_t pct, i;
+
+  for(tw = tcp_tw_pcbs; tw != NULL && used; tw = tw->next) { used--; }
+  pct = _pace_pct(used, m->avail);
+
+  for(i = 0; i < sizeof(pools); i++)
+  {
+    m = &lwip_stats.memp[pools[i]];
+    if(_pace_pct(m->used, m->avail) > pct) { pct = _pace_pct(m->used, m->avail); }
+  }
+  if(_pace_pct(lwip_stats.mem.used, lwip_stats.mem.avail) > pct)
+  {
+    pct = _pace_pct(lwip_stats.mem.used, lwip_stats.mem.avail);
+  }
+  pace.pool_pct = pct;
+  if(pct > pace.pool_peak_pct) { pace.pool_peak_pct = pct; }
+  return pct;
+}
+
+/**
+ * @brief pull the smoothed RTT out of the pcb (sa is scaled by 8 and counted
+ * in slow timer ticks)
+ */
+static void _pace_rtt_sample(http_sock_t * sock, struct tcp_pcb * tpcb)
+{
+  if(tpcb->sa > 0)
+  {
+    sock->rtt_ms = (uint32_t)(tpcb->sa >> 3) * TCP_SLOW_INTERVAL;
+    pace.rtt_ms = sock->rtt_ms;
+  }
+}
+
+/**
+ * @brief the window changes at most once per RTT, so a change has a chance
+ * to show up in the pools before the next one
+ */
+static uint8_t _pace_settled(uint32_t now)
+{
+  uint32_t rtt = pace.rtt_ms > TCP_SLOW_INTERVAL ? pace.rtt_ms : TCP_SLOW_INTERVAL;
+  return now - pace.last_change >= rtt;
+}
+
+/* multiplicative decrease on memory pressure */
+static void _pace_backoff(void)
+{
+  uint32_t now = sys_now();
+  if(!_pace_settled(now)) { return; }
+
+  pace.window = pace.window > 2 * HTTP_PACE_MIN_WND ? pace.window / 2 : HTTP_PACE_MIN_WND;
+  pace.last_change = now;
+  pace.backoffs++;
+  DEBUGF("pace: backoff, window %u", pace.window);
+}
+
+/* additive increase while the pools have room */
+static void _pace_grow(void)
+{
+  uint32_t now = sys_now();
+  if(pace.window >= HTTP_PACE_MAX_WND || !_pace_settled(now)) { return; }
+  if(_pace_pool_pct() >= HTTP_PACE_LOW_WM) { return; }
+
+  pace.window++;
+  pace.last_change = now;
+}
+
+/**
+ * @brief check if a new connect fits in the window and under the watermark
+ */
+static uint8_t _pace_admit(void)
+{
+  if(pace.inflight >= pace.window) { return 0; }
+  if(_pace_pool_pct() >= HTTP_PACE_HIGH_WM) { _pace_backoff(); return 0; }
+  return 1;
+}
+
+/**
+ * @brief give the window slot back, the connection may stay open (upgraded
+ * connections are long lived and must not hold back new requests)
+ */
+static void _pace_unslot(http_sock_t * sock)
+{
+  if(sock->paced && pace.inflight) { pace.inflight--; }
+  sock->paced = 0;
+}
+
+/**
+ * @brief connection is gone (closed or aborted), free its window slot
+ */
+static void _pace_release(http_sock_t * sock)
+{
+  if(sock->pcb == NULL) { return; }
+  sock->pcb = NULL;
+  _pace_unslot(sock);
+}
+
+/**
+ * @brief bytes that may be queued on the pcb right now. Above the high
+ * watermark only one segment is allowed, and only on an idle pcb, so the
+ * connection keeps moving without growing the pools.
+ */
+static u16_t _pace_budget(http_sock_t * sock, struct tcp_pcb * tpcb)
+{
+  u16_t left = sock->payload_len - sock->sent_len;
+  u16_t room = tcp_sndbuf(tpcb);
+
+  if(tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN) { return 0; }
+  if(_pace_pool_pct() >= HTTP_PACE_HIGH_WM)
+  {
+    if(tpcb->unsent != NULL || tpcb->unacked != NULL) { return 0; }
+    if(room > tcp_mss(tpcb)) { room = tcp_mss(tpcb); }
+  }
+  return left < room ? left : room;
+}
+
+const http_pace_t * http_pace_metrics(void)
+{
+  return &pace;
+}
+
 
 
+/**
+ * @brief drop whatever the socket still holds: the connection (reset, no
+ * callback), its pacer slot and the tls context
+ */
+static void _sock_drop(http_sock_t * sock)
+{
+  if(sock->pcb != NULL)
+  {
+    _pcb_detach(sock->pcb);
+    tcp_abort(sock->pcb);
+    _pace_release(sock);
+  }
+  _pace_unslot(sock);
+#if HTTP_TLS
+  if(sock->tls_setup)
+  {
+    if(sock->tls_rx != NULL) { pbuf_free(sock->tls_rx); }
+    sock->tls_rx = NULL;
+    mbedtls_ssl_free(&sock->ssl);
+    sock->tls_setup = 0;
+  }
+#endif
+}
 
 /**
-* @brief initalize http parameters
+* @brief initalize http parameters. The socket is registered with
+* handle_http and must stay valid (static storage) until http_deinit.
+* Calling it again on a registered socket drops its connection first.
 * @param  sock socket to be inialized
 * @param  port port to be used
 * @param id socket ID
@@ -59,10 +321,52 @@ void _err(void *arg, err_t err);
 */
 void http_init(http_sock_t * sock, http_cbfunc cb)
 {
+  http_sock_t * it;
+
   ASSERT_ERROR("socket is NULL", !sock, return);
   ASSERT_ERROR("callback is NULL", !cb, return);
 
+  /* a registered socket is being initialized again, only then are its
+     pcb, slot and tls fields meaningful */
+  for(it = sock_list; it != NULL && it != sock; it = it->next);
+  if(it != NULL) { _sock_drop(sock); }
+
   sock->callback=cb;
+  sock->pcb=NULL;
+  sock->paced=0;
+#if HTTP_WS
+  memset(&sock->ws, 0, sizeof(sock->ws));
+#endif
+
+#if HTTP_TLS
+  sock->tls_setup=0;
+  sock->tls_hs=0; sock->tls_pend=0; sock->tls_unacked=0;
+  sock->tls_rx=NULL; sock->tls_rx_off=0;
+  sock->tls_tx_start=0; sock->tls_rx_mark=0;
+  /* on failure tls stays set and tls_setup 0, _sock_ready then refuses the
+     socket instead of sending the request in the clear */
+  if(sock->tls && !tls_ready) { DEBUG("tls: http_tls_init not called"); }
+  else if(sock->tls)
+  {
+    int ret;
+    mbedtls_ssl_init(&sock->ssl);
+    ret = mbedtls_ssl_setup(&sock->ssl, &tls_conf);
+    if(ret != 0)
+    {
+      DEBUGF("tls: ssl setup failed -0x%04x", -ret);
+      mbedtls_ssl_free(&sock->ssl);
+    }
+    else
+    {
+      sock->tls_setup=1;
+      if(sock->tls_host != NULL) { mbedtls_ssl_set_hostname(&sock->ssl, sock->tls_host); }
+      mbedtls_ssl_set_bio(&sock->ssl, sock, _tls_bio_send, _tls_bio_recv, NULL);
+    }
+  }
+#endif
+
+  /* register once, handle_http walks this list */
+  if(it == NULL) { sock->next = sock_list; sock_list = sock; }
 
   if(!lwip_init)
   {
@@ -82,6 +386,23 @@ void http_init(http_sock_t * sock, http_cbfunc cb)
   //DEBUG("http init done");
 }
 
+/**
+ * @brief drop the connection (without callback) and unregister the socket,
+ * it may be freed once this returns
+ * @param  sock socket to be released
+ */
+void http_deinit(http_sock_t * sock)
+{
+  http_sock_t ** it;
+
+  for(it = &sock_list; *it != NULL && *it != sock; it = &(*it)->next);
+  if(*it == NULL) { return; } /* never registered */
+  *it = sock->next;
+
+  _sock_drop(sock);
+  sock->state=HTTP_IDLE;
+}
+
 
 
 /**
@@ -112,29 +433,20 @@ int http_request(
   char * req_str = sock->payload;
   char host[50];
   uint16_t req_str_len;
-  err_t err_result;
-  struct tcp_pcb * tpcb;
 
-  //Check ethernet Link & DHCP & not sending
-  ASSERT_ERROR("not connected",
-  (gnetif.flags & NETIF_FLAG_LINK_UP) == 0 || gnetif.dhcp->state != DHCP_BOUND,
-                            sock->state=HTTP_IDLE; return HTTP_ERR;);
-  ASSERT_ERROR("socket busy",
-      (sock->state == HTTP_CONN) | (sock->state == HTTP_SEND),return HTTP_ERR;);
+  if(_sock_ready(sock) != HTTP_OK) { return HTTP_ERR; }
 
   ASSERT("arg is NULL",arg);
 
   sock->arg=arg;
   sock->state=HTTP_CONN;
+#if HTTP_WS
+  sock->ws.mode=WS_OFF; /* plain request, even after a failed upgrade */
+#endif
 
 
   //SET_STATE(sock->state,HTTP_CONN);
-  /*Assemble host string*/
-  snprintf(host,50,"%lu.%lu.%lu.%lu",
-                                  sock->target_ip.addr >> 0   & 0xff,
-                                  sock->target_ip.addr >> 8   & 0xff,
-                                  sock->target_ip.addr >> 16  & 0xff,
-                                  sock->target_ip.addr >> 24  & 0xff);
+  _host_str(sock, host);
 
   /* Assemble the request string */
   req_str_len= snprintf(NULL, 0, message_fmt, REQ_ARGS); /* Measure message len */
@@ -146,10 +458,84 @@ int http_request(
   //DEBUG("req_str: ");
   //DEBUG(req_str);
 
+  #undef REQ_ARGS
+  return _submit(sock);
+}
+
+/**
+ * @brief check link, DHCP and that the socket is not in use
+ */
+static int _sock_ready(http_sock_t * sock)
+{
+  //Check ethernet Link & DHCP & not sending
+  ASSERT_ERROR("not connected",
+  (gnetif.flags & NETIF_FLAG_LINK_UP) == 0 || gnetif.dhcp->state != DHCP_BOUND,
+                            sock->state=HTTP_IDLE; return HTTP_ERR;);
+  ASSERT_ERROR("socket busy",
+      (sock->state == HTTP_CONN) | (sock->state == HTTP_SEND) |
+      (sock->state == HTTP_WAIT) | (sock->state == HTTP_RECV) |
+      (sock->state == HTTP_UPGRADED),return HTTP_ERR;);
+#if HTTP_TLS
+  /* never fall back to plaintext */
+  if(sock->tls && !sock->tls_setup) { DEBUG("tls: socket not set up"); return HTTP_ERR; }
+#endif
+  return HTTP_OK;
+}
+
+/*Assemble host string (buffer of at least 16 chars)*/
+static void _host_str(http_sock_t * sock, char * host)
+{
+  snprintf(host,16,"%lu.%lu.%lu.%lu",
+                                  sock->target_ip.addr >> 0   & 0xff,
+                                  sock->target_ip.addr >> 8   & 0xff,
+                                  sock->target_ip.addr >> 16  & 0xff,
+                                  sock->target_ip.addr >> 24  & 0xff);
+}
+
+/**
+ * @brief send the request stored in the socket payload, or leave it waiting
+ * if the pacer has no room
+ */
+static int _submit(http_sock_t * sock)
+{
+  sock->sent_len=0;
+  sock->acked_len=0;
+
+  /* hold the connect back until the pacer has room, handle_http retries */
+  if(!_pace_admit())
+  {
+    DEBUG("pace: connect deferred");
+    pace.deferred++;
+    sock->state=HTTP_WAIT;
+    return HTTP_OK;
+  }
+
+  return _start_connect(sock) == ERR_OK ? HTTP_OK : HTTP_ERR;
+}
+
+/* out of memory while connecting: back off and let handle_http retry */
+static err_t _connect_defer(http_sock_t * sock)
+{
+  pace.mem_errs++;
+  pace.deferred++;
+  _pace_backoff();
+  sock->state=HTTP_WAIT;
+  return ERR_OK;
+}
+
+/**
+ * @brief create the pcb and connect, takes a slot from the pacing window.
+ * Running out of pcbs or memory defers the connect instead of failing it.
+ */
+static err_t _start_connect(http_sock_t * sock)
+{
+  err_t err_result;
+  struct tcp_pcb * tpcb;
+
   /* configures the lwip callbacks for the current socket */
   DEBUG_OUTPUT("tcp_new");
   tpcb = tcp_new(); /* Creates a new TCP Protocol Control Block - TPCB */
-  ASSERT_ERROR("tpcb is NULL", tpcb == NULL,tcp_close(tpcb); return HTTP_ERR; ); /* Check for empty pcb */
+  if(tpcb == NULL) { DEBUG("tcp_new: no pcb, connect deferred"); return _connect_defer(sock); }
   tcp_arg(tpcb, sock); /* Give sock pointer to lwip as the argument passed to callbacks */
   tcp_sent(tpcb, _sent_cb); /*configures the "data sent" callback */
   tcp_recv(tpcb, _recv_cb); /*receive callback */
@@ -159,11 +545,66 @@ int http_request(
 
   /* connect to server */
   DEBUG("connecting..");
+  sock->state=HTTP_CONN;
   err_result=tcp_connect(tpcb, &sock->target_ip, sock->port, _connected);
-  ASSERT_ERROR("tcp_connect ", err_result!=ERR_OK, return HTTP_ERR);
+  if(err_result != ERR_OK)
+  {
+    tcp_close(tpcb); /* never connected, freed right away */
+    if(err_result == ERR_MEM) { DEBUG("tcp_connect: no memory, connect deferred"); return _connect_defer(sock); }
+    DEBUGF("tcp_connect err %d", err_result);
+    sock->state=HTTP_IDLE;
+#if HTTP_WS
+    sock->ws.mode=WS_OFF; /* the upgrade never started */
+#endif
+    return err_result;
+  }
 
-  #undef REQ_ARGS
-  return HTTP_OK;
+  sock->pcb=tpcb;
+  sock->paced=1;
+  pace.inflight++;
+  pace.admitted++;
+  return ERR_OK;
+}
+
+/**
+ * @brief queue as much of the payload as the pacer allows, the rest goes out
+ * from _sent_cb or handle_http
+ */
+static err_t _pace_write(http_sock_t * sock)
+{
+  struct tcp_pcb * tpcb = sock->pcb;
+  err_t err_result;
+  u16_t len;
+
+  if(tpcb == NULL || sock->sent_len >= sock->payload_len) { return ERR_OK; }
+#if HTTP_TLS
+  if(sock->tls) { return _tls_write(sock); }
+#endif
+
+  do
+  {
+    len = _pace_budget(sock, tpcb);
+    if(len == 0) { break; }
+    if(len < sock->payload_len - sock->sent_len) { pace.write_stalls++; }
+    /* websocket data may wrap around the end of the buffer */
+    if(len > HTTP_MAX_PAYLOAD_LEN - _tx_idx(sock->sent_len)) { len = HTTP_MAX_PAYLOAD_LEN - _tx_idx(sock->sent_len); }
+
+    err_result=tcp_write(tpcb, sock->payload + _tx_idx(sock->sent_len), len,
+                  sock->sent_len + len < sock->payload_len ? TCP_WRITE_FLAG_MORE : 0);
+    if(err_result == ERR_MEM)
+    {
+      /* not fatal, keep the data and retry once the pools drain */
+      pace.mem_errs++;
+      pace.write_stalls++;
+      _pace_backoff();
+      break;
+    }
+    if(err_result != ERR_OK) { DEBUGF("tcp_write err %d", err_result); return err_result; }
+
+    sock->sent_len += len;
+  } while(sock->sent_len < sock->payload_len && _tx_idx(sock->sent_len) == 0);
+  tcp_output(tpcb);
+  return ERR_OK;
 }
 
 /*connected callback*/
@@ -175,19 +616,70 @@ err_t _connected( void * arg, struct tcp_pcb * tpcb, err_t err)
   ASSERT("err != ERR_OK", err!=ERR_OK);
 
   DEBUG("connected");
+#if HTTP_TLS
+  if(sock->tls && !sock->tls_setup) { tcp_abort(tpcb); return ERR_ABRT; } /* _err reports it */
+  if(sock->tls) { return _tls_start(sock); }
+#endif
   sock->state=HTTP_SEND;
-  err_result=tcp_write(tpcb, sock->payload, sock->payload_len, 0x00);
-  ASSERT_ERROR("tcp_write err",err_result!=ERR_OK,
-              VAR_DUMP(err_result,"%d"); sock->callback(0 ,sock); return err_result;);
-  tcp_output(tpcb);
-  return err_result;
+  err_result=_pace_write(sock);
+  if(err_result != ERR_OK)
+  {
+    DEBUG("tcp_write err");
+    tcp_abort(tpcb); /* _err reports it and frees the slot */
+    return ERR_ABRT;
+  }
+  return ERR_OK;
 }
 
 /* sent callback */
 err_t _sent_cb(void  * arg, struct tcp_pcb * tpcb, u16_t len)
 {
+  http_sock_t * sock = (http_sock_t *)arg;
+
+  if(tpcb != sock->pcb) { return ERR_OK; } /* connection already handed back */
+
+#if HTTP_TLS
+  if(sock->tls)
+  {
+    /* len counts ciphertext, the plaintext is acked once nothing is in flight */
+    sock->tls_unacked = len < sock->tls_unacked ? sock->tls_unacked - len : 0;
+    if(sock->tls_hs) { _pace_rtt_sample(sock, tpcb); return _tls_step(sock); }
+    len = sock->tls_unacked == 0 && sock->tls_pend == 0 ? sock->sent_len - sock->acked_len : 0;
+    if(len && sock->tls_tx_start)
+    {
+      /* everything written so far is acked, close the transfer interval */
+      tls_stats.tx_ms += sys_now() - sock->tls_tx_start;
+      sock->tls_tx_start = 0;
+    }
+  }
+#endif
   DEBUGF("sent, %u bytes", len);
-  ((http_sock_t *)arg)->state=HTTP_IDLE;
+  _pace_rtt_sample(sock, tpcb);
+  sock->acked_len += len;
+  if(sock->acked_len >= HTTP_MAX_PAYLOAD_LEN)
+  {
+    /* websocket tx ring: keep the counters below twice the buffer size */
+    sock->payload_len -= HTTP_MAX_PAYLOAD_LEN;
+    sock->sent_len -= HTTP_MAX_PAYLOAD_LEN;
+    sock->acked_len -= HTTP_MAX_PAYLOAD_LEN;
+  }
+  if(sock->acked_len < sock->payload_len)
+  {
+    if(_pace_write(sock) != ERR_OK) { tcp_abort(tpcb); return ERR_ABRT; } /* _err reports it */
+    return ERR_OK;
+  }
+
+#if HTTP_WS
+  /* websocket: everything acked, the tx buffer can be reused */
+  if(sock->ws.mode == WS_OPEN || sock->ws.mode == WS_CLOSING)
+  {
+    sock->payload_len=0; sock->sent_len=0; sock->acked_len=0;
+    return ERR_OK;
+  }
+  if(sock->ws.mode != WS_OFF) { return ERR_OK; }
+#endif
+  /* stay busy until the answer (or an error/timeout) frees the connection */
+  sock->state=HTTP_RECV;
   return ERR_OK;
 }
 
@@ -198,6 +690,19 @@ err_t _recv_cb(void * arg, struct tcp_pcb * tpcb, struct pbuf * recv, err_t err)
   uint16_t result;
   char result_str[30];
 
+  if(tpcb != sock->pcb) /* connection already handed back */
+  {
+    if(recv != NULL) { tcp_recved(tpcb, recv->tot_len); pbuf_free(recv); }
+    return ERR_OK;
+  }
+
+#if HTTP_TLS
+  if(sock->tls) { return _tls_recv(sock, tpcb, recv); }
+#endif
+#if HTTP_WS
+  if(sock->ws.mode != WS_OFF) { return _ws_recv(sock, tpcb, recv); }
+#endif
+
   DEBUG("recv ans");
 
   sock->state=HTTP_RECV;
@@ -220,9 +725,9 @@ err_t _recv_cb(void * arg, struct tcp_pcb * tpcb, struct pbuf * recv, err_t err)
   to deallocate the packet buffer (pbuf), else,
   do nothing, so lwip code can reuse it */
   if(err==ERR_OK) { pbuf_free(recv); DEBUG("pbuf freed"); }
-  tpcb->state=8;/*/*Closing, BUG: needed because of bug in TCP/IP stack that
-  causes circular list to form (with a neverending check loop)*/
-  tcp_close(tpcb); DEBUG("conn close\r\n");
+  _pcb_close(tpcb); DEBUG("conn close\r\n");
+  _pace_release(sock);
+  _pace_grow();
   sock->state=HTTP_IDLE;
 
   sock->callback(result,sock);
@@ -235,6 +740,14 @@ void _err(void * arg, err_t err)
 {
   http_sock_t * sock = (http_sock_t *)arg;
   DEBUGF("\n\nTCP ERROR:%d\n",err);
+  if(err == ERR_MEM) { pace.mem_errs++; _pace_backoff(); }
+  _pace_release(sock); /* pcb is already freed by lwip */
+#if HTTP_TLS
+  _tls_reset(sock);
+#endif
+#if HTTP_WS
+  sock->ws.mode= WS_OFF;
+#endif
   sock->state= HTTP_IDLE;
   sock->callback(0, sock);
 }
@@ -243,39 +756,1021 @@ void _err(void * arg, err_t err)
 err_t _poll_cb(void * arg, struct tcp_pcb * tpcb)
 {
   http_sock_t * sock = (http_sock_t *)arg;
+  if(tpcb != sock->pcb) { tcp_poll(tpcb, _dummy2, 20); return ERR_OK; } /* already handed back */
+#if HTTP_WS
+  /* open websockets are kept alive by ping/pong from handle_http */
+  if(sock->ws.mode == WS_OPEN || sock->ws.mode == WS_CLOSING) { return ERR_OK; }
+#endif
   DEBUG("timeout reached, closing connection");
   sock->state= HTTP_IDLE;
-  tcp_poll(tpcb, _dummy2, 20);/*remove idle callback*/
-  /*BUG: set closing state before closing, else circular list loop*/
-  tpcb->state=8;
-  tcp_close(tpcb); DEBUG("tcp_close");
+#if HTTP_TLS
+  _tls_close(sock);
+#endif
+  _pcb_close(tpcb); DEBUG("tcp_close");
+  _pace_release(sock);
+#if HTTP_WS
+  sock->ws.mode= WS_OFF;
+#endif
   sock->callback(0,sock);
   return ERR_OK;
 }
 
+#if HTTP_WS
+/*---------- websocket ---------*/
 
-//for lissening PCB's -- unused for now
-err_t _accept(void *arg, struct tcp_pcb * newpcb, err_t err)
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define ROL(x,n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void _sha1_block(uint32_t h[5], const uint8_t * p)
 {
-  DEBUG("tcp accept configured");
-  return err;
+  uint32_t w[80], a, b, c, d, e, f, k, t;
+  uint8_t i;
+
+  for(i = 0; i < 16; i++)
+  {
+    w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 |
+           (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+  }
+  for(; i < 80; i++) { w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1); }
+
+  a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+  for(i = 0; i < 80; i++)
+  {
+    if(i < 20)      { f = (b & c) | (~b & d);           k = 0x5A827999; }
+    else if(i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+    else if(i < 60) { f = (b & c) | (b & d) | (c & d);  k = 0x8F1BBCDC; }
+    else            { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+    t = ROL(a, 5) + f + e + k + w[i];
+    e = d; d = c; c = ROL(b, 30); b = a; a = t;
+  }
+  h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
 }
 
-void handle_http(void) {
-  // pooling to check received packets and timeouts
-  LwIP_Periodic_Handle();
-  uint32_t timeNow = sys_now();
-  uint32_t ip = gnetif.dhcp->offered_ip_addr.addr;
+/**
+ * @brief SHA-1, only used to check Sec-WebSocket-Accept
+ */
+static void _sha1(const uint8_t * msg, uint16_t len, uint8_t out[20])
+{
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  uint32_t bits = (uint32_t)len * 8;
+  uint8_t blk[64];
+  uint16_t i, n;
 
-  char tmp[100];
-  if (timeNow >= tmr + 2000 || timeNow < tmr) {
-    DEBUGF("IP: %lu.%lu.%lu.%lu %16llu\t %9d",
-            ip >> 0 & 0xFF,
-            ip >> 8 & 0xFF,
-            ip >> 16 & 0xFF,
-            ip >> 24 & 0xFF,
-            rtc_get64(),
-            gnetif.dhcp->state);
+  for(i = 0; i + 64 <= len; i += 64) { _sha1_block(h, msg + i); }
+
+  n = len - i;
+  memset(blk, 0, 64);
+  memcpy(blk, msg + i, n);
+  blk[n] = 0x80;
+  if(n >= 56) { _sha1_block(h, blk); memset(blk, 0, 64); }
+  blk[60] = bits >> 24; blk[61] = bits >> 16; blk[62] = bits >> 8; blk[63] = bits;
+  _sha1_block(h, blk);
+
+  for(i = 0; i < 20; i++) { out[i] = h[i >> 2] >> (24 - 8 * (i & 3)); }
+}
+
+static void _base64(const uint8_t * in, uint16_t len, char * out)
+{
+  static const char tbl[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  uint32_t v;
+  uint16_t i;
+
+  for(i = 0; i < len; i += 3)
+  {
+    v = (uint32_t)in[i] << 16 |
+        (i + 1 < len ? (uint32_t)in[i+1] << 8 : 0) |
+        (i + 2 < len ? in[i+2] : 0);
+    *out++ = tbl[v >> 18 & 63];
+    *out++ = tbl[v >> 12 & 63];
+    *out++ = i + 1 < len ? tbl[v >> 6 & 63] : '=';
+    *out++ = i + 2 < len ? tbl[v & 63] : '=';
+  }
+  *out = '\0';
+}
+
+/* masking keys and the handshake nonce must not be predictable, rand() won't do */
+#ifndef LWIP_RAND
+#error "websocket masking needs LWIP_RAND (a hardware RNG), define it in lwipopts.h"
+#endif
+
+static uint32_t _ws_rand(void)
+{
+  return LWIP_RAND();
+}
+
+/**
+ * @brief append one masked frame to the socket tx buffer, _pace_write sends it
+ * @param  hdr0 first header byte (FIN | opcode)
+ */
+static err_t _ws_frame(http_sock_t * sock, uint8_t hdr0, const char * data, uint16_t len)
+{
+  uint8_t * out = (uint8_t *)sock->payload;
+  uint16_t pos = sock->payload_len;
+  uint32_t r = _ws_rand();
+  uint8_t mask[4];
+  uint16_t i;
+
+  /* only the unacked bytes are still owned by lwIP, the rest is free */
+  if(sock->payload_len - sock->acked_len + len + 8 > HTTP_MAX_PAYLOAD_LEN) { return ERR_BUF; }
+
+  out[_tx_idx(pos++)] = hdr0;
+  if(len < 126) { out[_tx_idx(pos++)] = 0x80 | len; }
+  else
+  {
+    out[_tx_idx(pos++)] = 0x80 | 126;
+    out[_tx_idx(pos++)] = len >> 8;
+    out[_tx_idx(pos++)] = len & 0xff;
+  }
+  memcpy(mask, &r, 4);
+  for(i = 0; i < 4; i++) { out[_tx_idx(pos++)] = mask[i]; }
+  for(i = 0; i < len; i++) { out[_tx_idx(pos++)] = data[i] ^ mask[i & 3]; }
+
+  sock->payload_len = pos;
+  return ERR_OK;
+}
+
+/**
+ * @brief detach from the pcb and close it
+ * @param  result passed to the socket callback (close code, 0 on failure)
+ */
+static void _ws_shutdown(http_sock_t * sock, uint16_t result)
+{
+  struct tcp_pcb * tpcb = sock->pcb;
+
+  DEBUGF("ws: closed (%u)", result);
+  if(tpcb != NULL)
+  {
+#if HTTP_TLS
+    _tls_close(sock);
+#endif
+    _pcb_close(tpcb);
+    _pace_release(sock);
+  }
+  sock->ws.mode = WS_OFF;
+  sock->state = HTTP_IDLE;
+  sock->callback(result, sock);
+}
+
+/* value of the header at line if it is called name, NULL otherwise */
+static const char * _ws_hdr(const char * line, const char * name)
+{
+  size_t n = strlen(name);
+
+  if(strncasecmp(line, name, n) != 0 || line[n] != ':') { return NULL; }
+  line += n + 1;
+  while(*line == ' ' || *line == '\t') { line++; }
+  return line;
+}
+
+/* word (case insensitive) starts at v and ends there, seps lists what may follow */
+static uint8_t _ws_word(const char * v, const char * word, const char * seps)
+{
+  size_t n = strlen(word);
+  return strncasecmp(v, word, n) == 0 && v[n] != '\0' && strchr(seps, v[n]) != NULL;
+}
+
+/* comma separated header value contains the token */
+static uint8_t _ws_has_token(const char * v, const char * token)
+{
+  while(*v != '\r' && *v != '\0')
+  {
+    if(_ws_word(v, token, " \t,\r")) { return 1; }
+    while(*v != ',' && *v != '\r' && *v != '\0') { v++; }
+    while(*v == ',' || *v == ' ' || *v == '\t') { v++; }
+  }
+  return 0;
+}
+
+/**
+ * @brief check the upgrade answer held in ws.rx (RFC 6455 4.1: Upgrade,
+ * Connection and Sec-WebSocket-Accept must all be right)
+ * @return 101 if accepted, the HTTP status if refused, 0 if malformed
+ */
+static uint16_t _ws_handshake(http_sock_t * sock)
+{
+  char key[24 + sizeof(WS_GUID)];
+  char expect[29];
+  uint8_t digest[20];
+  uint16_t result = 0;
+  uint8_t upgrade = 0, connection = 0, accept = 0;
+  const char * line;
+  const char * v;
+
+  sscanf(sock->ws.rx, "HTTP/1.1 %hu", &result);
+  if(result != 101) { return result; }
+
+  memcpy(key, sock->ws.key, 24);
+  memcpy(key + 24, WS_GUID, sizeof(WS_GUID) - 1);
+  _sha1((const uint8_t *)key, 24 + sizeof(WS_GUID) - 1, digest);
+  _base64(digest, 20, expect);
+
+  for(line = strstr(sock->ws.rx, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n"))
+  {
+    if((v = _ws_hdr(line + 2, "Upgrade")) != NULL)
+    {
+      upgrade = _ws_word(v, "websocket", " \t\r");
+    }
+    else if((v = _ws_hdr(line + 2, "Connection")) != NULL)
+    {
+      connection = _ws_has_token(v, "upgrade");
+    }
+    else if((v = _ws_hdr(line + 2, "Sec-WebSocket-Accept")) != NULL)
+    {
+      /* the whole value, not just a prefix of it */
+      accept = strncmp(v, expect, 28) == 0 && strchr(" \t\r", v[28]) != NULL;
+    }
+  }
+  return upgrade && connection && accept ? 101 : 0;
+}
+
+/**
+ * @brief a frame was fully received
+ * @return ERR_CLSD when the connection should go down, ws.ctrl then holds
+ * the close code
+ */
+static err_t _ws_frame_done(http_sock_t * sock)
+{
+  http_ws_t * ws = &sock->ws;
+  uint8_t fin = ws->hdr[0] & 0x80;
+  uint8_t op = ws->hdr[0] & 0x0f;
+
+  ws->hdr_len = 0;
+  ws->hdr_need = 2;
+
+  switch(op)
+  {
+    case WS_PING:
+      /* a dropped pong gets us timed out by the peer, fail loudly instead */
+      if(_ws_frame(sock, 0x80 | WS_PONG, ws->ctrl, ws->ctrl_len) != ERR_OK) { DEBUG("ws: no room for pong"); return ERR_BUF; }
+      return _pace_write(sock);
+    case WS_PONG:
+      if(ws->mode == WS_OPEN) { ws->ping_at = 0; }
+      return ERR_OK;
+    case WS_CLOSE:
+      /* echo the close, unless it answers ours */
+      if(ws->mode == WS_OPEN)
+      {
+        if(_ws_frame(sock, 0x80 | WS_CLOSE, ws->ctrl, ws->ctrl_len > 2 ? 2 : ws->ctrl_len) != ERR_OK)
+        {
+          DEBUG("ws: no room for close");
+          return ERR_BUF;
+        }
+        _pace_write(sock);
+      }
+      return ERR_CLSD;
+    default:
+      if(fin)
+      {
+        ws->callback(ws->msg_op, ws->rx, ws->rx_len, sock);
+        ws->msg_op = 0;
+      }
+      return ERR_OK;
+  }
+}
+
+/**
+ * @brief frame header is complete, decode length and validate
+ */
+static err_t _ws_frame_begin(http_sock_t * sock)
+{
+  http_ws_t * ws = &sock->ws;
+  uint8_t op = ws->hdr[0] & 0x0f;
+  uint8_t len = ws->hdr[1] & 0x7f;
+
+  switch(op)
+  {
+    case WS_CONT: case WS_TEXT: case WS_BIN:
+    case WS_CLOSE: case WS_PING: case WS_PONG:
+      break;
+    default:
+      DEBUGF("ws: reserved opcode 0x%x", op);
+      return ERR_VAL;
+  }
+  /* these guard the buffers below, keep them out of the debug macros */
+  if(ws->hdr[0] & 0x70) { return ERR_VAL; } /* no extensions negotiated */
+  if(ws->hdr[1] & 0x80) { return ERR_VAL; } /* servers don't mask */
+
+  if(len == 126) { ws->left = (uint16_t)ws->hdr[2] << 8 | ws->hdr[3]; }
+  else if(len == 127)
+  {
+    /* anything over 64k can't fit rx anyway */
+    if(ws->hdr[2] | ws->hdr[3] | ws->hdr[4] | ws->hdr[5] | ws->hdr[6] | ws->hdr[7]) { return ERR_VAL; }
+    ws->left = (uint16_t)ws->hdr[8] << 8 | ws->hdr[9];
+  }
+  else { ws->left = len; }
+
+  if(op & 0x08)
+  {
+    if(!(ws->hdr[0] & 0x80) || ws->left > sizeof(ws->ctrl)) { return ERR_VAL; }
+    ws->ctrl_len = 0;
+  }
+  else if(op == WS_CONT)
+  {
+    if(ws->msg_op == 0) { return ERR_VAL; }
+  }
+  else
+  {
+    if(ws->msg_op != 0) { return ERR_VAL; }
+    ws->msg_op = op;
+    ws->rx_len = 0;
+  }
+  return ERR_OK;
+}
+
+/**
+ * @brief incremental parser, fed one pbuf at a time
+ */
+static err_t _ws_parse(http_sock_t * sock, const uint8_t * buf, uint16_t len)
+{
+  http_ws_t * ws = &sock->ws;
+  err_t err_result;
+  uint16_t n;
+
+  while(len)
+  {
+    if(ws->mode == WS_HANDSHAKE)
+    {
+      if(ws->rx_len >= HTTP_WS_RX_LEN - 1) { DEBUG("ws: handshake answer too long"); return ERR_VAL; }
+      ws->rx[ws->rx_len++] = *buf++;
+      len--;
+      if(ws->rx_len >= 4 && memcmp(ws->rx + ws->rx_len - 4, "\r\n\r\n", 4) == 0)
+      {
+        uint16_t result;
+        ws->rx[ws->rx_len] = '\0';
+        result = _ws_handshake(sock);
+        if(result != 101) { _ws_shutdown(sock, result); return ERR_ABRT; }
+
+        DEBUG("ws: open");
+        tcp_nagle_disable(sock->pcb);
+        ws->mode = WS_OPEN;
+        ws->rx_len = 0;
+        ws->hdr_len = 0;
+        ws->hdr_need = 2;
+        ws->msg_op = 0;
+        if(sock->acked_len == sock->payload_len)
+        {
+          sock->payload_len=0; sock->sent_len=0; sock->acked_len=0;
+        }
+        sock->state = HTTP_UPGRADED;
+        _pace_unslot(sock);
+        _pace_grow();
+        sock->callback(result, sock);
+      }
+      continue;
+    }
+
+    if(ws->hdr_len < ws->hdr_need)
+    {
+      ws->hdr[ws->hdr_len++] = *buf++;
+      len--;
+      if(ws->hdr_len == 2)
+      {
+        n = ws->hdr[1] & 0x7f;
+        ws->hdr_need = n == 126 ? 4 : n == 127 ? 10 : 2;
+      }
+      if(ws->hdr_len < ws->hdr_need) { continue; }
+
+      err_result = _ws_frame_begin(sock);
+      if(err_result != ERR_OK) { return err_result; }
+    }
+    else
+    {
+      /* payload, copied in bulk */
+      n = len < ws->left ? len : ws->left;
+      if(ws->hdr[0] & 0x08)
+      {
+        memcpy(ws->ctrl + ws->ctrl_len, buf, n);
+        ws->ctrl_len += n;
+      }
+      else
+      {
+        if(ws->rx_len + n > HTTP_WS_RX_LEN) { DEBUG("ws: message too long"); return ERR_VAL; }
+        memcpy(ws->rx + ws->rx_len, buf, n);
+        ws->rx_len += n;
+      }
+      ws->left -= n;
+      buf += n;
+      len -= n;
+    }
+
+    if(ws->left == 0)
+    {
+      err_result = _ws_frame_done(sock);
+      if(err_result != ERR_OK) { return err_result; }
+    }
+  }
+  return ERR_OK;
+}
+
+/**
+ * @brief act on the parser result: close, protocol error or nothing
+ */
+static void _ws_finish(http_sock_t * sock, err_t err_result)
+{
+  if(err_result == ERR_CLSD)
+  {
+    uint8_t * c = (uint8_t *)sock->ws.ctrl;
+    _ws_shutdown(sock, sock->ws.ctrl_len >= 2 ? (uint16_t)c[0] << 8 | c[1] : 1005);
+  }
+  else if(err_result != ERR_OK && err_result != ERR_ABRT)
+  {
+    DEBUGF("ws: protocol error %d", err_result);
+    _ws_shutdown(sock, 0);
+  }
+}
+
+/*data received callback, websocket mode*/
+static err_t _ws_recv(http_sock_t * sock, struct tcp_pcb * tpcb, struct pbuf * recv)
+{
+  struct pbuf * q;
+  err_t err_result = ERR_OK;
+
+  if(recv == NULL) { _ws_shutdown(sock, 0); return ERR_OK; } /* remote closed */
+
+  tcp_recved(tpcb, recv->tot_len);
+  sock->ws.last_rx = sys_now();
+
+  for(q = recv; q != NULL && err_result == ERR_OK; q = q->next)
+  {
+    err_result = _ws_parse(sock, (const uint8_t *)q->payload, q->len);
+  }
+  pbuf_free(recv);
+
+  _ws_finish(sock, err_result);
+  return ERR_OK;
+}
+
+/**
+ * @brief ping when idle, drop the connection if the pong (or the answer to
+ * our close) doesn't come back in time
+ */
+static void _ws_keepalive(http_sock_t * sock, uint32_t now)
+{
+  http_ws_t * ws = &sock->ws;
+
+  if(ws->ping_at)
+  {
+    if(now - ws->ping_at >= HTTP_WS_PING_MS) { DEBUG("ws: peer not answering"); _ws_shutdown(sock, 0); }
+    return;
+  }
+  if(ws->mode == WS_OPEN && now - ws->last_rx >= HTTP_WS_PING_MS)
+  {
+    if(_ws_frame(sock, 0x80 | WS_PING, NULL, 0) == ERR_OK) { ws->ping_at = now | 1; }
+  }
+}
+
+/**
+ * Open a websocket to target on the socket server with the HTTP/1.1
+ * Upgrade handshake. The socket callback is called with 101 once the
+ * upgrade is accepted, and again when the connection goes down (with the
+ * close code, or 0 if it was lost).
+ *
+ * @param  sock          connection socket containing server ip and port (and more)
+ * @param  headers       extra headers, without trailing CRLF (may be "")
+ * @param  cb            message callback
+ * @param  arg           argument to be passed to callback
+ *
+ */
+int http_ws_open(http_sock_t * sock, const char * headers, http_ws_cbfunc cb, void * arg)
+{
+  #define REQ_ARGS sock->target, host, sock->ws.key, headers, *headers ? "\r\n" : ""
+  const char * message_fmt = "GET %s HTTP/1.1\r\nHost: %s\r\n"
+                             "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                             "Sec-WebSocket-Key: %s\r\nSec-WebSocket-Version: 13\r\n%s%s\r\n";
+  uint8_t nonce[16];
+  char host[16];
+  uint16_t req_str_len;
+  uint8_t i;
+
+  if(cb == NULL) { DEBUG("callback is NULL"); return HTTP_ERR; }
+  if(_sock_ready(sock) != HTTP_OK) { return HTTP_ERR; }
+
+  memset(&sock->ws, 0, sizeof(sock->ws));
+  for(i = 0; i < 16; i++) { nonce[i] = _ws_rand(); }
+  _base64(nonce, 16, sock->ws.key);
+  _host_str(sock, host);
+  if(headers == NULL) { headers = ""; }
+
+  req_str_len = snprintf(NULL, 0, message_fmt, REQ_ARGS);
+  /* guards the payload buffer, keep it out of the debug macros */
+  if(req_str_len >= HTTP_MAX_PAYLOAD_LEN) { DEBUG("ws: upgrade request too long"); return HTTP_ERR; }
+  snprintf(sock->payload, HTTP_MAX_PAYLOAD_LEN, message_fmt, REQ_ARGS);
+  sock->payload_len = req_str_len;
+
+  sock->arg = arg;
+  sock->state = HTTP_CONN;
+  sock->ws.mode = WS_HANDSHAKE;
+  sock->ws.callback = cb;
+
+  #undef REQ_ARGS
+  return _submit(sock);
+}
+
+/**
+ * Send a message on an open websocket. Data messages are cut in fragments
+ * sized to the current send window, so the first one leaves right away.
+ * Fails if the tx buffer has no room, retry later.
+ *
+ * @param  sock   upgraded socket
+ * @param  opcode WS_TEXT, WS_BIN or WS_PING (use http_ws_close to close)
+ * @param  msg    message data
+ * @param  len    message length
+ */
+int http_ws_send(http_sock_t * sock, uint8_t opcode, const char * msg, uint16_t len)
+{
+  uint16_t frag, frames, n;
+  uint8_t op = opcode;
+
+  /* plain checks, these must survive builds without the debug macros */
+  if(sock->state != HTTP_UPGRADED || sock->ws.mode != WS_OPEN) { DEBUG("ws: socket not open"); return HTTP_ERR; }
+  if(opcode != WS_TEXT && opcode != WS_BIN && opcode != WS_PING) { DEBUG("ws: opcode not allowed"); return HTTP_ERR; }
+  if((opcode & 0x08) && len > 125) { DEBUG("ws: control frame too long"); return HTTP_ERR; }
+
+  frag = tcp_sndbuf(sock->pcb);
+  frag = frag > HTTP_WS_MIN_FRAG + 8 ? frag - 8 : HTTP_WS_MIN_FRAG;
+  if((opcode & 0x08) || frag > len) { frag = len; }
+  frames = frag ? (len + frag - 1) / frag : 1;
+  if(sock->payload_len - sock->acked_len + len + frames * 8 > HTTP_MAX_PAYLOAD_LEN) { DEBUG("ws: tx buffer full"); return HTTP_ERR; }
+
+  do
+  {
+    n = len < frag ? len : frag;
+    len -= n;
+    _ws_frame(sock, (len ? 0x00 : 0x80) | op, msg, n);
+    msg += n;
+    op = WS_CONT;
+  } while(len);
+
+  return _pace_write(sock) == ERR_OK ? HTTP_OK : HTTP_ERR;
+}
+
+/**
+ * Start the closing handshake, the socket callback gets the code once the
+ * server answers (or HTTP_WS_PING_MS passes).
+ */
+int http_ws_close(http_sock_t * sock, uint16_t code)
+{
+  char c[2];
+
+  if(sock->state != HTTP_UPGRADED || sock->ws.mode != WS_OPEN) { DEBUG("ws: socket not open"); return HTTP_ERR; }
+
+  c[0] = code >> 8;
+  c[1] = code & 0xff;
+  if(_ws_frame(sock, 0x80 | WS_CLOSE, c, 2) != ERR_OK) { DEBUG("ws: tx buffer full"); return HTTP_ERR; }
+  sock->ws.mode = WS_CLOSING;
+  sock->ws.ping_at = sys_now() | 1;
+  return _pace_write(sock) == ERR_OK ? HTTP_OK : HTTP_ERR;
+}
+
+#endif /* HTTP_WS */
+
+#if HTTP_TLS
+/*---------- tls ---------*/
+
+
+static tls_cache_t * _tls_cache_find(http_sock_t * sock)
+{
+  uint8_t i;
+  for(i = 0; i < HTTP_TLS_CACHE_LEN; i++)
+  {
+    if(tls_cache[i].valid && tls_cache[i].ip == sock->target_ip.addr &&
+        tls_cache[i].port == sock->port)
+    {
+      return &tls_cache[i];
+    }
+  }
+  return NULL;
+}
+
+/* keep the negotiated session, replacing the oldest entry */
+static void _tls_cache_store(http_sock_t * sock)
+{
+  tls_cache_t * e = _tls_cache_find(sock);
+
+  if(e == NULL)
+  {
+    e = &tls_cache[tls_cache_next];
+    tls_cache_next = (tls_cache_next + 1) % HTTP_TLS_CACHE_LEN;
+  }
+  mbedtls_ssl_session_free(&e->session);
+  e->valid = mbedtls_ssl_get_session(&sock->ssl, &e->session) == 0;
+  e->ip = sock->target_ip.addr;
+  e->port = sock->port;
+}
+
+/**
+ * @brief BIO send: ciphertext goes straight to tcp_write. It has to be
+ * copied, mbedtls reuses its record buffer as soon as this returns.
+ */
+static int _tls_bio_send(void * ctx, const unsigned char * buf, size_t len)
+{
+  http_sock_t * sock = (http_sock_t *)ctx;
+  struct tcp_pcb * tpcb = sock->pcb;
+  err_t err_result;
+  u16_t n;
+
+  if(tpcb == NULL) { return MBEDTLS_ERR_NET_CONN_RESET; }
+
+  n = tcp_sndbuf(tpcb);
+  if(n > len) { n = len; }
+  if(n == 0 || tcp_sndqueuelen(tpcb) >= TCP_SND_QUEUELEN) { return MBEDTLS_ERR_SSL_WANT_WRITE; }
+
+  err_result = tcp_write(tpcb, buf, n, TCP_WRITE_FLAG_COPY);
+  if(err_result == ERR_MEM)
+  {
+    pace.mem_errs++;
+    _pace_backoff();
+    return MBEDTLS_ERR_SSL_WANT_WRITE;
+  }
+  if(err_result != ERR_OK) { return MBEDTLS_ERR_NET_SEND_FAILED; }
+
+  sock->tls_unacked += n;
+  return n;
+}
+
+/**
+ * @brief BIO recv: read from the queued pbuf chain, each pbuf is freed and
+ * its window reopened as soon as it is consumed
+ */
+static int _tls_bio_recv(void * ctx, unsigned char * buf, size_t len)
+{
+  http_sock_t * sock = (http_sock_t *)ctx;
+  struct pbuf * p = sock->tls_rx;
+  u16_t n;
+
+  if(p == NULL) { return MBEDTLS_ERR_SSL_WANT_READ; }
+
+  n = pbuf_copy_partial(p, buf, len > 0xffff ? 0xffff : len, sock->tls_rx_off);
+  sock->tls_rx_off += n;
+  while(p != NULL && sock->tls_rx_off >= p->len)
+  {
+    struct pbuf * q = p->next;
+    sock->tls_rx_off -= p->len;
+    if(q != NULL) { pbuf_ref(q); pbuf_dechain(p); }
+    pbuf_free(p);
+    p = q;
+  }
+  sock->tls_rx = p;
+
+  if(sock->pcb != NULL) { tcp_recved(sock->pcb, n); }
+  return n;
+}
+
+/**
+ * @brief drop queued ciphertext and per-connection state
+ */
+static void _tls_reset(http_sock_t * sock)
+{
+  if(!sock->tls) { return; }
+  if(sock->tls_rx != NULL) { pbuf_free(sock->tls_rx); }
+  sock->tls_rx = NULL;
+  sock->tls_rx_off = 0;
+  sock->tls_hs = 0;
+  sock->tls_pend = 0;
+  sock->tls_unacked = 0;
+  sock->tls_tx_start = 0;
+  sock->tls_rx_mark = 0;
+}
+
+/**
+ * @brief send close_notify (if the session is up) before the pcb is closed
+ */
+static void _tls_close(http_sock_t * sock)
+{
+  if(!sock->tls) { return; }
+  if(!sock->tls_hs && sock->pcb != NULL)
+  {
+    mbedtls_ssl_close_notify(&sock->ssl);
+    tcp_output(sock->pcb);
+  }
+  _tls_reset(sock);
+}
+
+/**
+ * @brief connected: start the handshake, offering the cached session
+ */
+static err_t _tls_start(http_sock_t * sock)
+{
+  tls_cache_t * e = _tls_cache_find(sock);
+
+  mbedtls_ssl_session_reset(&sock->ssl);
+  if(e != NULL) { mbedtls_ssl_set_session(&sock->ssl, &e->session); }
+  sock->tls_hs = 1;
+  sock->tls_resumed = 0;
+  sock->tls_start = sys_now();
+  return _tls_step(sock);
+}
+
+/**
+ * @brief drive the handshake as far as the data at hand allows, then send
+ * the request once it is done. Aborts the pcb on failure.
+ */
+static err_t _tls_step(http_sock_t * sock)
+{
+  struct tcp_pcb * tpcb = sock->pcb;
+  uint32_t elapsed;
+  int ret = 0;
+
+  while(sock->ssl.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+  {
+    ret = mbedtls_ssl_handshake_step(&sock->ssl);
+    /* the handshake params are gone once it is over, check on the way */
+    if(sock->ssl.handshake != NULL && sock->ssl.handshake->resume) { sock->tls_resumed = 1; }
+    if(ret != 0) { break; }
+  }
+  tcp_output(tpcb);
+
+  if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) { return ERR_OK; }
+  if(ret != 0)
+  {
+    DEBUGF("tls: handshake failed -0x%04x", -ret);
+    tls_stats.failures++;
+    {
+      tls_cache_t * e = _tls_cache_find(sock);
+      if(e != NULL) { e->valid = 0; }
+    }
+    tcp_abort(tpcb); /* _err reports it */
+    return ERR_ABRT;
+  }
+
+  elapsed = sys_now() - sock->tls_start;
+  if(sock->tls_resumed) { tls_stats.resumed++; tls_stats.resumed_ms = elapsed; }
+  else { tls_stats.full++; tls_stats.full_ms = elapsed; }
+  DEBUGF("tls: %s handshake, %lu ms", sock->tls_resumed ? "resumed" : "full", elapsed);
+  _tls_cache_store(sock);
+
+  sock->tls_hs = 0;
+  sock->state = HTTP_SEND;
+  if(_pace_write(sock) != ERR_OK) { tcp_abort(tpcb); return ERR_ABRT; }
+  return ERR_OK;
+}
+
+/**
+ * @brief encrypt the pending payload, one record per segment so the peer
+ * can decrypt each one as it lands instead of waiting for a 16k record
+ */
+static err_t _tls_write(http_sock_t * sock)
+{
+  struct tcp_pcb * tpcb = sock->pcb;
+  int exp = mbedtls_ssl_get_record_expansion(&sock->ssl);
+  u16_t rec, len;
+  int ret;
+
+  if(sock->tls_hs) { return ERR_OK; }
+  if(exp < 0) { exp = 64; } /* expansion unknown, assume the worst block cipher */
+
+  rec = HTTP_TLS_RECORD_LEN ? HTTP_TLS_RECORD_LEN :
+        tcp_mss(tpcb) > 2 * exp ? tcp_mss(tpcb) - exp : tcp_mss(tpcb);
+
+  while(sock->sent_len < sock->payload_len)
+  {
+    /* a record that hit WANT_WRITE must be retried with the same length */
+    len = sock->tls_pend;
+    if(len == 0)
+    {
+      len = _pace_budget(sock, tpcb);
+      if(len > rec) { len = rec; }
+      if(len + exp > tcp_sndbuf(tpcb)) { len = tcp_sndbuf(tpcb) > exp ? tcp_sndbuf(tpcb) - exp : 0; }
+      if(len > HTTP_MAX_PAYLOAD_LEN - _tx_idx(sock->sent_len)) { len = HTTP_MAX_PAYLOAD_LEN - _tx_idx(sock->sent_len); }
+      if(len == 0) { break; }
+    }
+
+    if(sock->tls_tx_start == 0) { sock->tls_tx_start = sys_now() | 1; }
+    ret = mbedtls_ssl_write(&sock->ssl, (const unsigned char *)sock->payload + _tx_idx(sock->sent_len), len);
+    if(ret == MBEDTLS_ERR_SSL_WANT_WRITE) { sock->tls_pend = len; pace.write_stalls++; break; }
+    if(ret < 0) { DEBUGF("tls: write failed -0x%04x", -ret); return ERR_VAL; }
+
+    sock->tls_pend = 0;
+    sock->sent_len += ret;
+    tls_stats.records++;
+    tls_stats.tx_bytes += ret;
+  }
+  tcp_output(tpcb);
+  return ERR_OK;
+}
+
+/**
+ * @brief plain http over tls: answer (or EOF) received, close and report
+ */
+static void _tls_answer(http_sock_t * sock, struct tcp_pcb * tpcb, const char * data, int len)
+{
+  char result_str[16];
+  uint16_t result = 0;
+
+  if(data != NULL)
+  {
+    len = len < 15 ? len : 15;
+    memcpy(result_str, data, len);
+    result_str[len] = '\0';
+    sscanf(result_str,"HTTP/1.1 %hu %*s",&result);
+  }
+
+  _tls_close(sock);
+  _pcb_close(tpcb); DEBUG("conn close\r\n");
+  _pace_release(sock);
+  _pace_grow();
+  sock->state=HTTP_IDLE;
+  sock->callback(result,sock);
+}
+
+/*data received callback, tls transport*/
+static err_t _tls_recv(http_sock_t * sock, struct tcp_pcb * tpcb, struct pbuf * recv)
+{
+  char buf[256];
+  err_t err_result;
+  uint32_t now;
+  int ret;
+
+  if(recv == NULL) /* remote closed */
+  {
+#if HTTP_WS
+    if(sock->ws.mode != WS_OFF) { _ws_shutdown(sock, 0); return ERR_OK; }
+#endif
+    _tls_answer(sock, tpcb, NULL, 0);
+    return ERR_OK;
+  }
+
+  if(sock->tls_rx == NULL) { sock->tls_rx = recv; }
+  else { pbuf_cat(sock->tls_rx, recv); }
+
+  if(sock->tls_hs)
+  {
+    err_result = _tls_step(sock);
+    if(err_result != ERR_OK || sock->tls_hs) { return err_result; }
+  }
+
+  /* receive time: gaps between segments count, idle periods (longer than
+     a couple of RTTs) do not */
+  now = sys_now();
+  if(sock->tls_rx_mark && now - sock->tls_rx_mark <= 2 * sock->rtt_ms + TCP_SLOW_INTERVAL)
+  {
+    tls_stats.rx_ms += now - sock->tls_rx_mark;
+  }
+  sock->tls_rx_mark = now | 1;
+
+  /* stop once the connection has been handed back */
+  while(sock->pcb == tpcb)
+  {
+    ret = mbedtls_ssl_read(&sock->ssl, (unsigned char *)buf, sizeof(buf));
+    if(ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE) { break; }
+    if(ret <= 0)
+    {
+      /* close_notify, EOF or a fatal alert */
+      DEBUGF("tls: read -0x%04x", -ret);
+#if HTTP_WS
+      if(sock->ws.mode != WS_OFF) { _ws_shutdown(sock, 0); break; }
+#endif
+      _tls_answer(sock, tpcb, NULL, 0);
+      break;
+    }
+
+    tls_stats.rx_bytes += ret;
+#if HTTP_WS
+    if(sock->ws.mode != WS_OFF)
+    {
+      sock->ws.last_rx = sys_now();
+      err_result = _ws_parse(sock, (const uint8_t *)buf, ret);
+      if(err_result != ERR_OK) { _ws_finish(sock, err_result); break; }
+      continue;
+    }
+#endif
+    _tls_answer(sock, tpcb, buf, ret);
+    break;
+  }
+  return ERR_OK;
+}
+
+/**
+ * Set up the shared TLS configuration, call once before http_init on
+ * sockets with tls set. Needs an entropy source (MBEDTLS_ENTROPY_HARDWARE_ALT
+ * on most targets).
+ *
+ * @param  ca_pem  CA certificate(s) used to verify servers, PEM including the
+ *                 terminating NUL. NULL skips verification (testing only).
+ * @param  ca_len  length of ca_pem
+ */
+int http_tls_init(const unsigned char * ca_pem, size_t ca_len)
+{
+  const char * pers = "lwip-http";
+  uint8_t i;
+  int ret;
+
+  if(tls_ready) { return HTTP_OK; } /* sockets already point at tls_conf */
+  mbedtls_ssl_config_init(&tls_conf);
+  mbedtls_entropy_init(&tls_entropy);
+  mbedtls_ctr_drbg_init(&tls_drbg);
+  mbedtls_x509_crt_init(&tls_ca);
+  for(i = 0; i < HTTP_TLS_CACHE_LEN; i++)
+  {
+    mbedtls_ssl_session_init(&tls_cache[i].session);
+    tls_cache[i].valid = 0;
+  }
+
+  ret = mbedtls_ctr_drbg_seed(&tls_drbg, mbedtls_entropy_func, &tls_entropy,
+                              (const unsigned char *)pers, strlen(pers));
+  if(ret != 0) { DEBUG("tls: drbg seed failed"); return HTTP_ERR; }
+  ret = mbedtls_ssl_config_defaults(&tls_conf, MBEDTLS_SSL_IS_CLIENT,
+                              MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if(ret != 0) { DEBUG("tls: config failed"); return HTTP_ERR; }
+  mbedtls_ssl_conf_rng(&tls_conf, mbedtls_ctr_drbg_random, &tls_drbg);
+
+  if(ca_pem != NULL)
+  {
+    ret = mbedtls_x509_crt_parse(&tls_ca, ca_pem, ca_len);
+    if(ret != 0) { DEBUG("tls: bad CA certificate"); return HTTP_ERR; }
+    mbedtls_ssl_conf_ca_chain(&tls_conf, &tls_ca, NULL);
+    mbedtls_ssl_conf_authmode(&tls_conf, MBEDTLS_SSL_VERIFY_REQUIRED);
+  }
+  else
+  {
+    DEBUG("tls: no CA given, servers are NOT verified");
+    mbedtls_ssl_conf_authmode(&tls_conf, MBEDTLS_SSL_VERIFY_NONE);
+  }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+  mbedtls_ssl_conf_session_tickets(&tls_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+  mbedtls_ssl_conf_max_frag_len(&tls_conf, HTTP_TLS_MFL);
+#endif
+  tls_ready = 1;
+  return HTTP_OK;
+}
+
+const http_tls_t * http_tls_metrics(void)
+{
+  return &tls_stats;
+}
+#endif /* HTTP_TLS */
+
+//for lissening PCB's -- unused for now
+err_t _accept(void *arg, struct tcp_pcb * newpcb, err_t err)
+{
+  DEBUG("tcp accept configured");
+  return err;
+}
+
+void handle_http(void) {
+  // pooling to check received packets and timeouts
+  LwIP_Periodic_Handle();
+  uint32_t timeNow = sys_now();
+  uint32_t ip = gnetif.dhcp->offered_ip_addr.addr;
+
+  http_sock_t * sock;
+
+  char tmp[100];
+
+  /* admit deferred connects and resume stalled writes */
+  for(sock = sock_list; sock != NULL; sock = sock->next)
+  {
+    err_t err_result;
+    if(sock->state == HTTP_WAIT && _pace_admit())
+    {
+      err_result = _start_connect(sock);
+      if(err_result != ERR_OK) { DEBUG("deferred connect failed"); sock->callback(0, sock); }
+    }
+#if HTTP_WS
+    else if(sock->state == HTTP_UPGRADED)
+    {
+      _ws_keepalive(sock, timeNow);
+    }
+#endif
+#if HTTP_TLS
+    /* a handshake flight cut short by WANT_WRITE with nothing in flight gets
+       no _sent_cb to resume it */
+    if(sock->state == HTTP_CONN && sock->pcb != NULL && sock->tls && sock->tls_hs)
+    {
+      _tls_step(sock); /* aborts the pcb on failure, _err reports it */
+    }
+#endif
+    if((sock->state == HTTP_SEND || sock->state == HTTP_UPGRADED) &&
+        sock->pcb != NULL && sock->sent_len < sock->payload_len)
+    {
+      err_result = _pace_write(sock);
+      if(err_result != ERR_OK) { DEBUG("deferred write failed"); tcp_abort(sock->pcb); } /* _err reports it */
+    }
+  }
+
+  if (timeNow >= tmr + 2000 || timeNow < tmr) {
+    DEBUGF("IP: %lu.%lu.%lu.%lu %16llu\t %9d",
+            ip >> 0 & 0xFF,
+            ip >> 8 & 0xFF,
+            ip >> 16 & 0xFF,
+            ip >> 24 & 0xFF,
+            rtc_get64(),
+            gnetif.dhcp->state);
+    DEBUGF("pace: wnd %u inflight %u pool %u%% (peak %u%%) rtt %lums "
+           "adm %lu def %lu stall %lu mem %lu bo %lu",
+            pace.window, pace.inflight, pace.pool_pct, pace.pool_peak_pct,
+            pace.rtt_ms, pace.admitted, pace.deferred, pace.write_stalls,
+            pace.mem_errs, pace.backoffs);
+#if HTTP_TLS
+    DEBUGF("tls: full %lu (%lums) resumed %lu (%lums) fail %lu rec %lu tx %lu (%lums) rx %lu (%lums)",
+            tls_stats.full, tls_stats.full_ms, tls_stats.resumed, tls_stats.resumed_ms,
+            tls_stats.failures, tls_stats.records, tls_stats.tx_bytes, tls_stats.tx_ms,
+            tls_stats.rx_bytes, tls_stats.rx_ms);
+#endif
   tmr = timeNow;
   }
 }
@@ -9,10 +9,55 @@
 #include "hw_uart1.h"
 #include "string.h"
 
+/* --------- TLS --------- */
+#ifndef HTTP_TLS
+#define HTTP_TLS 0                /**< build the mbedTLS transport*/
+#endif
+#if HTTP_TLS
+#include "mbedtls/ssl.h"
+#ifndef HTTP_TLS_CACHE_LEN
+#define HTTP_TLS_CACHE_LEN 2      /**< servers whose session is kept for resumption*/
+#endif
+#ifndef HTTP_TLS_RECORD_LEN
+#define HTTP_TLS_RECORD_LEN 0     /**< plaintext per record, 0 fits each record in one MSS*/
+#endif
+#ifndef HTTP_TLS_MFL
+#define HTTP_TLS_MFL MBEDTLS_SSL_MAX_FRAG_LEN_NONE /**< max fragment length asked to the server*/
+#endif
+#endif /* HTTP_TLS */
+
 /* --------- Defines --------- */
 #define HTTP_MAX_PAYLOAD_LEN  4000
 #define HTTP_R_OK 200
 
+/* --------- Pacing --------- */
+#ifndef HTTP_PACE_HIGH_WM
+#define HTTP_PACE_HIGH_WM 75 /**< pool occupancy (%) above which connects and writes are held back*/
+#endif
+#ifndef HTTP_PACE_LOW_WM
+#define HTTP_PACE_LOW_WM 50  /**< pool occupancy (%) under which the window is allowed to grow*/
+#endif
+#ifndef HTTP_PACE_MAX_WND
+#define HTTP_PACE_MAX_WND 8  /**< max number of simultaneous connections*/
+#endif
+#define HTTP_PACE_MIN_WND 1
+
+/* --------- WebSocket --------- */
+#ifndef HTTP_WS
+#define HTTP_WS 0              /**< build the websocket client*/
+#endif
+#if HTTP_WS
+#ifndef HTTP_WS_RX_LEN
+#define HTTP_WS_RX_LEN 512     /**< largest message (and handshake answer) accepted*/
+#endif
+#ifndef HTTP_WS_PING_MS
+#define HTTP_WS_PING_MS 15000  /**< idle time before a ping, and time to wait for the pong*/
+#endif
+#ifndef HTTP_WS_MIN_FRAG
+#define HTTP_WS_MIN_FRAG 128   /**< smallest fragment when the send window is short*/
+#endif
+#endif /* HTTP_WS */
+
 
 /* --------- Enums --------- */
 
@@ -25,8 +70,34 @@ enum conn_state {
   HTTP_CONN = 1,  /* connecting */
   HTTP_SEND = 2,  /* sending */
   HTTP_RECV = 3,  /* receiving data */
+  HTTP_WAIT = 4,  /* waiting for the pacer to admit the connect */
+  HTTP_UPGRADED = 5,  /* upgraded to websocket */
+};
+
+#if HTTP_WS
+/**
+ * @brief websocket frame opcodes
+ */
+enum ws_opcode {
+  WS_CONT  = 0x0, /* continuation */
+  WS_TEXT  = 0x1,
+  WS_BIN   = 0x2,
+  WS_CLOSE = 0x8,
+  WS_PING  = 0x9,
+  WS_PONG  = 0xA,
 };
 
+/**
+ * @brief websocket mode of a socket
+ */
+enum ws_mode {
+  WS_OFF = 0,       /* plain http */
+  WS_HANDSHAKE = 1, /* upgrade request sent, waiting for 101 */
+  WS_OPEN = 2,      /* exchanging frames */
+  WS_CLOSING = 3,   /* close frame sent, waiting for the answer */
+};
+#endif
+
 /**
  * @brief HTTP return codes
 */
@@ -43,8 +114,73 @@ enum http_err {
  */
 typedef void (*http_cbfunc)(uint16_t result, void * arg);
 
+#if HTTP_WS
+/**
+ * @typedef http_ws_cbfunc
+ * websocket message callback func type, arg is the socket.
+ */
+typedef void (*http_ws_cbfunc)(uint8_t opcode, const char * msg, uint16_t len, void * arg);
+#endif
+
 /*------Storage Classes-------*/
 
+/**
+ * @brief pacing controller state, exposed as metrics
+ */
+typedef struct pace {
+  uint8_t window;         /**< current limit of simultaneous connections*/
+  uint8_t inflight;       /**< connections currently open*/
+  uint8_t pool_pct;       /**< last sampled pool occupancy (%)*/
+  uint8_t pool_peak_pct;  /**< highest sampled pool occupancy (%)*/
+  uint32_t rtt_ms;        /**< last sampled smoothed RTT*/
+  uint32_t admitted;      /**< connects issued*/
+  uint32_t deferred;      /**< connects held back by the pacer*/
+  uint32_t write_stalls;  /**< writes cut short by the pacer*/
+  uint32_t mem_errs;      /**< ERR_MEM returned by the stack*/
+  uint32_t backoffs;      /**< window reductions*/
+  uint32_t last_change;   /**< time (ms) of the last window change*/
+} http_pace_t;
+
+#if HTTP_TLS
+/**
+ * @brief TLS transport metrics
+ */
+typedef struct tls {
+  uint32_t full;          /**< full handshakes*/
+  uint32_t resumed;       /**< resumed handshakes*/
+  uint32_t failures;      /**< failed handshakes*/
+  uint32_t full_ms;       /**< duration of the last full handshake*/
+  uint32_t resumed_ms;    /**< duration of the last resumed handshake*/
+  uint32_t records;       /**< records written*/
+  uint32_t tx_bytes;      /**< plaintext bytes written*/
+  uint32_t tx_ms;         /**< time with written data not yet acked*/
+  uint32_t rx_bytes;      /**< plaintext bytes read*/
+  uint32_t rx_ms;         /**< time spent receiving, idle gaps excluded*/
+} http_tls_t;
+#endif
+
+#if HTTP_WS
+/**
+ * @brief websocket receive parser and keepalive state
+ */
+typedef struct ws {
+  uint8_t mode;                 /**< ws_mode*/
+  char key[25];                 /**< Sec-WebSocket-Key sent on the upgrade*/
+  uint8_t hdr[10];              /**< frame header being assembled*/
+  uint8_t hdr_len;              /**< header bytes received*/
+  uint8_t hdr_need;             /**< header bytes expected*/
+  uint8_t msg_op;               /**< opcode of the message being reassembled, 0 if none*/
+  uint16_t left;                /**< payload bytes left in the current frame*/
+  char rx[HTTP_WS_RX_LEN];      /**< handshake answer / message reassembly*/
+  uint16_t rx_len;              /**< bytes in rx*/
+  char ctrl[125];               /**< control frame payload*/
+  uint8_t ctrl_len;             /**< bytes in ctrl*/
+  uint32_t last_rx;             /**< time (ms) of the last received data*/
+  uint32_t ping_at;             /**< time (ms) of the unanswered ping or close, 0 if none*/
+  http_ws_cbfunc callback;      /**< message callback*/
+} http_ws_t;
+#endif
+
 /**
  * @brief used to store connection variables and parameters
  */
@@ -58,18 +194,74 @@ typedef struct socket {
   char * target;                      /**< server target (file)*/
   http_cbfunc callback;               /**< callback function*/
   void * arg;                         /**< argument*/
+  struct tcp_pcb * pcb;               /**< current connection pcb*/
+  uint8_t paced;                      /**< connection holds a pacer window slot*/
+  uint16_t sent_len;                  /**< payload bytes handed to tcp_write*/
+  uint16_t acked_len;                 /**< payload bytes acknowledged*/
+  uint32_t rtt_ms;                    /**< smoothed RTT of the connection*/
+#if HTTP_WS
+  http_ws_t ws;                       /**< websocket state*/
+#endif
+#if HTTP_TLS
+  uint8_t tls;                        /**< use TLS (set before http_init)*/
+  const char * tls_host;              /**< server name for SNI and certificate check*/
+  mbedtls_ssl_context ssl;            /**< TLS context*/
+  uint8_t tls_setup;                  /**< ssl context set up by http_init*/
+  uint8_t tls_hs;                     /**< handshake in progress*/
+  uint8_t tls_resumed;                /**< current handshake resumes a session*/
+  uint16_t tls_pend;                  /**< plaintext of a record not fully flushed*/
+  uint32_t tls_unacked;               /**< ciphertext bytes not acked*/
+  uint32_t tls_start;                 /**< handshake start time (ms)*/
+  struct pbuf * tls_rx;               /**< received ciphertext not consumed*/
+  uint16_t tls_rx_off;                /**< consumed bytes of tls_rx*/
+  uint32_t tls_tx_start;              /**< time (ms) the unacked data was first written, 0 if none*/
+  uint32_t tls_rx_mark;               /**< time (ms) of the last received data segment, 0 if none*/
+#endif
+  struct socket * next;               /**< next registered socket*/
 } http_sock_t;
 
 /*--- functions ----- */
 
 
+/**
+ * @brief register the socket, handle_http walks it until http_deinit: it must
+ * not go out of scope (or be freed) before that, use static storage
+ */
 void http_init(http_sock_t *,http_cbfunc cb);
 
+/**
+ * @brief drop the connection and unregister the socket
+ */
+void http_deinit(http_sock_t * sock);
+
 int http_request(http_sock_t * sock, const char * method,/* const char * host,
   const char * target,*/const char * headers,const char * payload,void * arg);
 
+#if HTTP_WS
+int http_ws_open(http_sock_t * sock, const char * headers, http_ws_cbfunc cb, void * arg);
+
+int http_ws_send(http_sock_t * sock, uint8_t opcode, const char * msg, uint16_t len);
+
+int http_ws_close(http_sock_t * sock, uint16_t code);
+#endif
+
+#if HTTP_TLS
+int http_tls_init(const unsigned char * ca_pem, size_t ca_len);
+
+/**
+ * @brief TLS handshake and throughput metrics
+ */
+const http_tls_t * http_tls_metrics(void);
+#endif
+
+/**
+ * @brief pacing controller metrics
+ */
+const http_pace_t * http_pace_metrics(void);
+
 /**
- * @brief handler for connection and DHCP pooling
+ * @brief handler for connection and DHCP pooling, also admits deferred
+ * connects and resumes stalled writes
  */
 void handle_http(void);
 